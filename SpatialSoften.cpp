@@ -2,7 +2,9 @@
 
 auto VS_CC spatialsoftenInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
 	auto d = reinterpret_cast<SpatialSoftenData *>(*instanceData);
-	vsapi->setVideoInfo(d->vi, 1, node);
+	vsapi->setVideoInfo(&d->out_vi, 1, node);
+	d->luma_saturated = d->luma_threshold == 255.;
+	d->chroma_saturated = d->chroma_threshold == 255.;
 	auto pixel = static_cast<PixelType>(d->vi->format->bytesPerSample);
 	switch (pixel) {
 	case PixelType::Integer9to16:
@@ -20,31 +22,137 @@ auto VS_CC spatialsoftenInit(VSMap *in, VSMap *out, void **instanceData, VSNode
 
 auto VS_CC spatialsoftenGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)->const VSFrameRef *{
 	auto d = reinterpret_cast<SpatialSoftenData *>(*instanceData);
-	if (activationReason == arInitial)
+	if (activationReason == arInitial) {
 		vsapi->requestFrameFilter(n, d->node, frameCtx);
+		if (d->mask)
+			vsapi->requestFrameFilter(n, d->mask, frameCtx);
+	}
 	else if (activationReason == arAllFramesReady) {
 		auto src = vsapi->getFrameFilter(n, d->node, frameCtx);
-		auto dst = vsapi->copyFrame(src, core);
+		auto mask = d->mask ? vsapi->getFrameFilter(n, d->mask, frameCtx) : nullptr;
 		auto fi = d->vi->format;
+		auto fo = d->out_vi.format;
+		auto dst = d->convert ? vsapi->newVideoFrame(fo, d->vi->width, d->vi->height, src, core) : vsapi->copyFrame(src, core);
 		auto pixel = static_cast<PixelType>(fi->bytesPerSample);
+		auto out_pixel = static_cast<PixelType>(fo->bytesPerSample);
 		auto pmax = (1 << fi->bitsPerSample) - 1;
 		auto diameter = (d->radius << 1) + 1;
 		for (auto plane = 0; plane < fi->numPlanes; ++plane) {
-			if (fi->colorFamily != cmRGB) {
-				if (plane == 0 && d->luma_threshold == 0.)
-					continue;
-				if (plane == 1 && d->chroma_threshold == 0.)
-					break;
-			}
 			auto src_stride = vsapi->getStride(src, plane) / fi->bytesPerSample;
-			auto dst_stride = vsapi->getStride(dst, plane) / fi->bytesPerSample;
+			auto dst_stride = vsapi->getStride(dst, plane) / fo->bytesPerSample;
 			auto dstp = vsapi->getWritePtr(dst, plane);
 			auto srcp = vsapi->getReadPtr(src, plane);
 			auto h = vsapi->getFrameHeight(src, plane);
 			auto w = vsapi->getFrameWidth(src, plane);
+			auto converter = DepthConverter{ fi, fo, d->dither, plane, w, limitedRange(src, vsapi) };
+			auto dispatch = [&](auto &&f) {
+				auto with_output = [&](auto srcp, auto sum_type) {
+					switch (out_pixel) {
+					case PixelType::Single:
+						f(srcp, reinterpret_cast<float *>(dstp), sum_type);
+						break;
+					case PixelType::Integer9to16:
+						f(srcp, reinterpret_cast<uint16_t *>(dstp), sum_type);
+						break;
+					default:
+						f(srcp, dstp, sum_type);
+						break;
+					}
+				};
+				switch (pixel) {
+				case PixelType::Single:
+					with_output(reinterpret_cast<const float *>(srcp), 0.);
+					break;
+				case PixelType::Integer9to16:
+					with_output(reinterpret_cast<const uint16_t *>(srcp), 0ll);
+					break;
+				default:
+					with_output(srcp, 0ll);
+					break;
+				}
+			};
+			auto occupancy = MaskOccupancy{ mask, plane, w, h, vsapi };
+			if (occupancy.occupied == 0 || (fi->colorFamily != cmRGB && (plane == 0 ? d->luma_threshold == 0. : d->chroma_threshold == 0.))) {
+				if (d->convert)
+					dispatch([&](auto srcp, auto dstp, auto) {
+						converter.convert_plane(srcp, src_stride, dstp, dst_stride, w, h);
+					});
+				continue;
+			}
 			auto current_threshold = (plane == 0 || fi->colorFamily == cmRGB) ? d->luma_threshold : d->chroma_threshold;
+			auto saturated = (plane == 0 || fi->colorFamily == cmRGB) ? d->luma_saturated : d->chroma_saturated;
+			auto copy = [&](auto srcp, auto dstp, auto x) {
+				if (d->convert)
+					converter.store(dstp, x, srcp[x]);
+				else
+					dstp[x] = static_cast<decltype(dstp[0] + 0)>(srcp[x]);
+			};
+			auto write = [&](auto dstp, auto x, auto sum, auto div) {
+				if (d->convert) {
+					converter.store(dstp, x, static_cast<double>(sum) / div);
+					return;
+				}
+				if (pixel != PixelType::Single) {
+					sum += div / 2;
+					sum /= div;
+					sum = sum < 0 ? 0 : sum > pmax ? pmax : sum;
+				}
+				else
+					sum /= div;
+				dstp[x] = static_cast<decltype(dstp[0] + 0)>(sum);
+			};
+			if (saturated) {
+				auto box = [&](auto srcp, auto dstp, auto sum_type) {
+					auto line = [&](auto y) {
+						return srcp + src_stride * (y > h - 1 ? h - 1 : y < 0 ? 0 : y);
+					};
+					auto column = std::vector<decltype(sum_type)>(w);
+					for (auto i = -d->radius; i <= d->radius; ++i)
+						for (auto x = 0; x < w; ++x)
+							column[x] += line(i)[x];
+					auto div = diameter * diameter;
+					for (auto y = 0; y < h; ++y) {
+						auto rowp = line(y);
+						if (occupancy.row(y)) {
+							auto x = 0;
+							for (; x < d->radius && x < w; ++x)
+								copy(rowp, dstp, x);
+							decltype(sum_type) sum = 0;
+							for (auto j = 0; j < diameter - 1 && j < w; ++j)
+								sum += column[j];
+							for (; x < w - d->radius; ++x) {
+								sum += column[x + d->radius];
+								if (occupancy.pixel(x, y))
+									write(dstp, x, sum, div);
+								else
+									copy(rowp, dstp, x);
+								sum -= column[x - d->radius];
+							}
+							for (; x < w; ++x)
+								copy(rowp, dstp, x);
+						}
+						else if (d->convert)
+							for (auto x = 0; x < w; ++x)
+								copy(rowp, dstp, x);
+						auto leaving = line(y - d->radius);
+						auto entering = line(y + d->radius + 1);
+						for (auto x = 0; x < w; ++x)
+							column[x] += static_cast<decltype(sum_type)>(entering[x]) - leaving[x];
+						dstp += dst_stride;
+						converter.next_line();
+					}
+				};
+				dispatch(box);
+				continue;
+			}
 			for (auto y = 0; y < h; ++y) {
 				auto kernel = [&](auto srcp, auto dstp, auto sum_type) {
+					if (!occupancy.row(y)) {
+						if (d->convert)
+							for (auto x = 0; x < w; ++x)
+								copy(srcp + y * src_stride, dstp + y * dst_stride, x);
+						return;
+					}
 					decltype(srcp) line[65];
 					for (auto i = 0; i < diameter; ++i)
 						line[i] = srcp + src_stride *
@@ -52,9 +160,13 @@ auto VS_CC spatialsoftenGetFrame(int n, int activationReason, void **instanceDat
 						return x > max ? max : x < min ? min : x;
 					}(y + i - (diameter >> 1), 0, h - 1);
 					auto x = 0;
-					for (; x < d->radius; ++x)
-						dstp[y * dst_stride + x] = srcp[y * src_stride + x];
+					for (; x < std::min(w, d->radius); ++x)
+						copy(line[d->radius], dstp + y * dst_stride, x);
 					for (; x < w - d->radius; ++x) {
+						if (!occupancy.pixel(x, y)) {
+							copy(line[d->radius], dstp + y * dst_stride, x);
+							continue;
+						}
 						auto div = 0;
 						decltype(sum_type) sum = 0;
 						auto center = static_cast<decltype(sum_type)>(srcp[y * src_stride + x]);
@@ -64,32 +176,17 @@ auto VS_CC spatialsoftenGetFrame(int n, int activationReason, void **instanceDat
 									sum += line[i][x + j];
 									++div;
 								}
-						if (pixel != PixelType::Single) {
-							sum += div / 2;
-							sum /= div;
-							sum = sum < 0 ? 0 : sum > pmax ? pmax : sum;
-						}
-						else
-							sum /= div;
-						dstp[y * dst_stride + x] = static_cast<decltype(dstp[0] + 0)>(sum);
+						write(dstp + y * dst_stride, x, sum, div);
 					}
 					for (; x < w; ++x)
-						dstp[y * dst_stride + x] = srcp[y * src_stride + x];
+						copy(line[d->radius], dstp + y * dst_stride, x);
 				};
-				switch (pixel) {
-				case PixelType::Single:
-					kernel(reinterpret_cast<const float *>(srcp), reinterpret_cast<float *>(dstp), 0.);
-					break;
-				case PixelType::Integer9to16:
-					kernel(reinterpret_cast<const uint16_t *>(srcp), reinterpret_cast<uint16_t *>(dstp), 0ll);
-					break;
-				default:
-					kernel(srcp, dstp, 0ll);
-					break;
-				}
+				dispatch(kernel);
+				converter.next_line();
 			}
 		}
 		vsapi->freeFrame(src);
+		vsapi->freeFrame(mask);
 		return dst;
 	}
 	return nullptr;
@@ -98,6 +195,7 @@ auto VS_CC spatialsoftenGetFrame(int n, int activationReason, void **instanceDat
 auto VS_CC spatialsoftenFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
 	auto d = reinterpret_cast<SpatialSoftenData *>(instanceData);
 	vsapi->freeNode(d->node);
+	vsapi->freeNode(d->mask);
 	delete d;
 }
 
@@ -150,10 +248,58 @@ auto VS_CC spatialsoftenCreate(const VSMap *in, VSMap *out, void *userData, VSCo
 		vsapi->freeNode(data->node);
 		return;
 	}
+	auto output_depth = static_cast<int>(vsapi->propGetInt(in, "output_depth", 0, &err));
+	auto same_format = err != 0;
+	if (err)
+		output_depth = data->vi->format->bitsPerSample;
+	data->dither = static_cast<DitherType>(vsapi->propGetInt(in, "dither", 0, &err));
+	if (err)
+		data->dither = DitherType::None;
+	if ((output_depth < 8 || output_depth > 16) && output_depth != 32) {
+		vsapi->setError(out, "SpatialSoften: output_depth must be between 8 and 16 (inclusive), or 32");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	if (data->dither != DitherType::None && data->dither != DitherType::Ordered && data->dither != DitherType::ErrorDiffusion) {
+		vsapi->setError(out, "SpatialSoften: dither must be 0 (round), 1 (ordered) or 2 (error diffusion)");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	data->out_vi = *data->vi;
+	data->out_vi.format = same_format ? data->vi->format : outputFormat(data->vi->format, output_depth, core, vsapi);
+	if (!data->out_vi.format) {
+		vsapi->setError(out, "SpatialSoften: output_depth is not supported for this input format");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	data->convert = data->out_vi.format != data->vi->format || (data->dither != DitherType::None && data->out_vi.format->sampleType == stInteger);
+	data->mask = vsapi->propGetNode(in, "mask", 0, &err);
+	if (err)
+		data->mask = nullptr;
+	if (data->mask) {
+		auto mi = vsapi->getVideoInfo(data->mask);
+		auto error = static_cast<const char *>(nullptr);
+		if (!mi->format)
+			error = "SpatialSoften: only constant format mask supported";
+		else if (mi->format->bitsPerSample == 16 && mi->format->sampleType == stFloat)
+			error = "SpatialSoften: half precision mask not supported!";
+		else if (mi->width != data->vi->width || mi->height != data->vi->height)
+			error = "SpatialSoften: mask must have the same dimensions as clip";
+		else if (mi->format->colorFamily != cmGray && data->vi->format->colorFamily != cmGray && (mi->format->subSamplingW != data->vi->format->subSamplingW || mi->format->subSamplingH != data->vi->format->subSamplingH))
+			error = "SpatialSoften: mask must be Gray or have the same subsampling as clip";
+		else if (mi->numFrames < data->vi->numFrames)
+			error = "SpatialSoften: mask must have at least as many frames as clip";
+		if (error) {
+			vsapi->setError(out, error);
+			vsapi->freeNode(data->mask);
+			vsapi->freeNode(data->node);
+			return;
+		}
+	}
 	vsapi->createFilter(in, out, "SpatialSoften", spatialsoftenInit, spatialsoftenGetFrame, spatialsoftenFree, fmParallel, 0, data, core);
 	return;
 }
 
 auto spatialsoftenRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
-	registerFunc("SpatialSoften", "clip:clip;radius:int:opt;luma_threshold:float:opt;chroma_threshold:float:opt", spatialsoftenCreate, 0, plugin);
+	registerFunc("SpatialSoften", "clip:clip;radius:int:opt;luma_threshold:float:opt;chroma_threshold:float:opt;output_depth:int:opt;dither:int:opt;mask:clip:opt", spatialsoftenCreate, 0, plugin);
 }
@@ -2,7 +2,9 @@
 
 auto VS_CC temporalsoftenInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
 	auto d = reinterpret_cast<TemporalSoftenData *>(*instanceData);
-	vsapi->setVideoInfo(d->vi, 1, node);
+	vsapi->setVideoInfo(&d->out_vi, 1, node);
+	d->luma_saturated = d->luma_threshold == 255.;
+	d->chroma_saturated = d->chroma_threshold == 255.;
 	d->scenechange *= d->vi->width / 32 * 32 * d->vi->height;
 	auto pixel = static_cast<PixelType>(d->vi->format->bytesPerSample);
 	switch (pixel) {
@@ -23,160 +25,330 @@ auto VS_CC temporalsoftenInit(VSMap *in, VSMap *out, void **instanceData, VSNode
 
 auto VS_CC temporalsoftenGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)->const VSFrameRef *{
 	auto d = reinterpret_cast<TemporalSoftenData *>(*instanceData);
+	auto group = n / d->batch * d->batch;
+	auto outputs = std::min(d->batch, d->vi->numFrames - group);
 	if (activationReason == arInitial) {
-		auto first = n - d->radius;
-		auto last = n + d->radius;
+		auto first = group - d->radius_back;
+		auto last = group + outputs - 1 + d->radius_forward;
 		first = first < 0 ? 0 : first;
 		last = last > d->vi->numFrames - 1 ? d->vi->numFrames - 1 : last;
 		for (auto i = first; i <= last; ++i)
 			vsapi->requestFrameFilter(i, d->node, frameCtx);
+		if (d->mask)
+			for (auto i = group; i < group + outputs; ++i)
+				vsapi->requestFrameFilter(i, d->mask, frameCtx);
 	}
 	else if (activationReason == arAllFramesReady) {
-		decltype(vsapi->getFrameFilter(0, nullptr, nullptr)) src[16];
-		bool planeDisabled[16];
+		auto batched = false;
+		if (d->batch > 1) {
+			std::lock_guard<std::mutex> lock{ d->batch_mutex };
+			auto stashed = d->batch_frames.find(n);
+			if (stashed != d->batch_frames.end()) {
+				auto frame = stashed->second;
+				d->batch_frames.erase(stashed);
+				return frame;
+			}
+			if (d->batch_pending.count(group) == 0) {
+				d->batch_pending.insert(group);
+				batched = true;
+			}
+			else
+				d->batch_claimed.insert(n);
+		}
+		if (d->batch > 1 && !batched) {
+			group = n;
+			outputs = 1;
+		}
+		decltype(vsapi->getFrameFilter(0, nullptr, nullptr)) src[32];
+		decltype(vsapi->copyFrame(nullptr, nullptr)) dst[16];
+		decltype(vsapi->getFrameFilter(0, nullptr, nullptr)) mask[16];
+		bool planeDisabled[16][16];
+		bool unfiltered[16];
+		bool dropped[16];
 		for (auto &x : src)
 			x = nullptr;
 		for (auto &x : planeDisabled)
+			for (auto &y : x)
+				y = false;
+		for (auto &x : unfiltered)
+			x = false;
+		for (auto &x : dropped)
 			x = false;
-		for (auto i = n - d->radius; i <= n + d->radius; ++i)
-			src[i - n + d->radius] = vsapi->getFrameFilter(std::min(d->vi->numFrames - 1, std::max(i, 0)), d->node, frameCtx);
-		auto dst = vsapi->copyFrame(src[d->radius], core);
+		// outputs of the group requested meanwhile are rendered by their own requests, stop working on them
+		auto drop_claimed = [&] {
+			if (!batched)
+				return;
+			std::lock_guard<std::mutex> lock{ d->batch_mutex };
+			for (auto k = 0; k < outputs; ++k)
+				if (group + k != n && !dropped[k] && d->batch_claimed.erase(group + k))
+					dropped[k] = true;
+		};
+		for (auto k = 0; k < 16; ++k)
+			mask[k] = d->mask && k < outputs ? vsapi->getFrameFilter(group + k, d->mask, frameCtx) : nullptr;
+		for (auto i = group - d->radius_back; i < group + outputs + d->radius_forward; ++i)
+			src[i - group + d->radius_back] = vsapi->getFrameFilter(std::min(d->vi->numFrames - 1, std::max(i, 0)), d->node, frameCtx);
 		auto fi = d->vi->format;
+		auto fo = d->out_vi.format;
+		for (auto k = 0; k < outputs; ++k)
+			dst[k] = d->convert ? vsapi->newVideoFrame(fo, d->vi->width, d->vi->height, src[k + d->radius_back], core) : vsapi->copyFrame(src[k + d->radius_back], core);
 		auto pixel = static_cast<PixelType>(fi->bytesPerSample);
+		auto out_pixel = static_cast<PixelType>(fo->bytesPerSample);
 		auto pmax = (1 << fi->bitsPerSample) - 1;
 		for (auto plane = 0; plane < fi->numPlanes; ++plane) {
-			if (fi->colorFamily != cmRGB) {
-				if (plane == 0 && d->luma_threshold == 0.)
-					continue;
-				if (plane == 1 && d->chroma_threshold == 0.)
-					break;
-			}
 			auto current_threshold = (plane == 0 || fi->colorFamily == cmRGB) ? d->luma_threshold : d->chroma_threshold;
-			auto dd = 0;
-			decltype(vsapi->getStride(nullptr, 0)) src_stride[16];
-			decltype(vsapi->getStride(nullptr, 0)) src_stride_trimmed[16];
-			decltype(vsapi->getReadPtr(nullptr, 0)) srcp[16];
-			decltype(vsapi->getReadPtr(nullptr, 0)) srcp_trimmed[16];
-			for (auto i = 0; i < d->radius; ++i) {
-				src_stride[dd] = vsapi->getStride(src[i], plane);
-				srcp[dd] = vsapi->getReadPtr(src[i], plane);
-				++dd;
-			}
-			for (auto i = 1; i <= d->radius; ++i) {
-				src_stride[dd] = vsapi->getStride(src[d->radius + i], plane);
-				srcp[dd] = vsapi->getReadPtr(src[d->radius + i], plane);
-				++dd;
-			}
-			auto dst_stride = vsapi->getStride(dst, plane);
-			auto dstp = vsapi->getWritePtr(dst, plane);
-			auto h = vsapi->getFrameHeight(src[d->radius], plane);
-			auto w = vsapi->getFrameWidth(src[d->radius], plane);
-			if (d->scenechange > 0.) {
-				auto dd2 = 0;
-				auto skiprest = false;
-				auto scenechange_lambda = [&](auto srcp, auto dstp, auto sum_type, auto i) {
-					decltype(sum_type) scenevalues = 0;
-					auto wp = w / 32 * 32;
-					for (auto y = 0; y < h; ++y)
-						for (auto x = 0; x < wp; ++x)
-							scenevalues += std::abs(static_cast<decltype(scenevalues)>(srcp[x + y * src_stride[i] / sizeof(srcp[0])]) - dstp[x + y * dst_stride / sizeof(dstp[0])]);
-					if (scenevalues < d->scenechange) {
-						src_stride_trimmed[dd2] = src_stride[i];
-						srcp_trimmed[dd2] = reinterpret_cast<decltype(srcp_trimmed[0])>(srcp);
-						++dd2;
-					}
-					else
-						skiprest = true;
-					planeDisabled[i] = skiprest;
-				};
-				for (auto i = d->radius - 1; i >= 0; --i)
-					if (!skiprest && !planeDisabled[i])
-						switch (pixel) {
-						case PixelType::Single:
-							scenechange_lambda(reinterpret_cast<const float *>(srcp[i]), reinterpret_cast<float *>(dstp), 0., i);
-							break;
-						case PixelType::Integer9to16:
-							scenechange_lambda(reinterpret_cast<const uint16_t *>(srcp[i]), reinterpret_cast<uint16_t *>(dstp), 0ll, i);
-							break;
-						default:
-							scenechange_lambda(srcp[i], dstp, 0ll, i);
-							break;
-						}
-					else
-						planeDisabled[i] = true;
-				skiprest = false;
-				for (auto i = 0; i < d->radius; ++i)
-					if (!skiprest && !planeDisabled[i + d->radius])
-						switch (pixel) {
-						case PixelType::Single:
-							scenechange_lambda(reinterpret_cast<const float *>(srcp[i + d->radius]), reinterpret_cast<float *>(dstp), 0., i + d->radius);
-							break;
-						case PixelType::Integer9to16:
-							scenechange_lambda(reinterpret_cast<const uint16_t *>(srcp[i + d->radius]), reinterpret_cast<uint16_t *>(dstp), 0ll, i + d->radius);
-							break;
-						default:
-							scenechange_lambda(srcp[i + d->radius], dstp, 0ll, i + d->radius);
-							break;
-						}
-					else
-						planeDisabled[i + d->radius] = true;
-				std::memcpy(srcp, srcp_trimmed, dd2 * sizeof(srcp[0]));
-				std::memcpy(src_stride, src_stride_trimmed, dd2 * sizeof(src_stride[0]));
-				dd = dd2;
-			}
-			if (dd < 1) {
-				for (auto x : src)
-					vsapi->freeFrame(x);
-				return dst;
-			}
-			auto div = dd + 1;
-			for (auto y = 0; y < h; ++y) {
-				auto accumulate_line = [&](auto srcp, auto dstp, auto sum_type) {
-					for (auto x = 0; x < w; ++x) {
-						decltype(sum_type) sum = dstp[x];
-						for (auto frame = dd - 1; frame >= 0; --frame) {
-							auto absolute = std::abs(static_cast<decltype(sum)>(dstp[x]) - srcp[frame][x]);
-							if (absolute <= current_threshold)
-								sum += srcp[frame][x];
-							else
-								sum += dstp[x];
+			auto saturated = (plane == 0 || fi->colorFamily == cmRGB) ? d->luma_saturated : d->chroma_saturated;
+			auto h = vsapi->getFrameHeight(src[d->radius_back], plane);
+			auto w = vsapi->getFrameWidth(src[d->radius_back], plane);
+			drop_claimed();
+			TemporalSoftenWindow window[16];
+			auto converter = std::vector<DepthConverter>{};
+			auto occupancy = std::vector<MaskOccupancy>{};
+			for (auto k = 0; k < outputs; ++k) {
+				auto frames = src + k;
+				converter.emplace_back(fi, fo, d->dither, plane, w, limitedRange(frames[d->radius_back], vsapi));
+				occupancy.emplace_back(mask[k], plane, w, h, vsapi);
+				if (dropped[k])
+					continue;
+				auto skip = unfiltered[k] || occupancy[k].occupied == 0;
+				if (fi->colorFamily != cmRGB && (plane == 0 ? d->luma_threshold == 0. : d->chroma_threshold == 0.))
+					skip = true;
+				if (skip && !d->convert)
+					continue;
+				auto dd = 0;
+				decltype(vsapi->getStride(nullptr, 0)) src_stride[16];
+				decltype(vsapi->getStride(nullptr, 0)) src_stride_trimmed[16];
+				decltype(vsapi->getReadPtr(nullptr, 0)) srcp[16];
+				decltype(vsapi->getReadPtr(nullptr, 0)) srcp_trimmed[16];
+				for (auto i = 0; i < d->radius_back; ++i) {
+					src_stride[dd] = vsapi->getStride(frames[i], plane);
+					srcp[dd] = vsapi->getReadPtr(frames[i], plane);
+					++dd;
+				}
+				for (auto i = 1; i <= d->radius_forward; ++i) {
+					src_stride[dd] = vsapi->getStride(frames[d->radius_back + i], plane);
+					srcp[dd] = vsapi->getReadPtr(frames[d->radius_back + i], plane);
+					++dd;
+				}
+				auto dst_stride = vsapi->getStride(dst[k], plane);
+				auto dstp = vsapi->getWritePtr(dst[k], plane);
+				auto center_stride = d->convert ? vsapi->getStride(frames[d->radius_back], plane) : dst_stride;
+				auto centerp = d->convert ? vsapi->getReadPtr(frames[d->radius_back], plane) : dstp;
+				if (skip)
+					dd = 0;
+				if (d->scenechange > 0. && !skip) {
+					auto dd2 = 0;
+					auto skiprest = false;
+					// rows the mask doesn't touch are left out of the difference and the threshold shrinks to match
+					auto scenechange = occupancy[k].occupied == h ? d->scenechange : d->scenechange * occupancy[k].occupied / h;
+					auto scenechange_lambda = [&](auto srcp, auto centerp, auto sum_type, auto i) {
+						decltype(sum_type) scenevalues = 0;
+						auto wp = w / 32 * 32;
+						for (auto y = 0; y < h; ++y) {
+							if (!occupancy[k].row(y))
+								continue;
+							for (auto x = 0; x < wp; ++x)
+								scenevalues += std::abs(static_cast<decltype(scenevalues)>(srcp[x + y * src_stride[i] / sizeof(srcp[0])]) - centerp[x + y * center_stride / sizeof(centerp[0])]);
 						}
-						if (pixel != PixelType::Single) {
-							sum += div / 2;
-							sum /= div;
-							sum = sum < 0 ? 0 : sum > pmax ? pmax : sum;
+						if (scenevalues < scenechange) {
+							src_stride_trimmed[dd2] = src_stride[i];
+							srcp_trimmed[dd2] = reinterpret_cast<decltype(srcp_trimmed[0])>(srcp);
+							++dd2;
 						}
 						else
-							sum /= div;
-						dstp[x] = static_cast<decltype(dstp[0] + 0)>(sum);
+							skiprest = true;
+						planeDisabled[k][i] = skiprest;
+					};
+					for (auto i = d->radius_back - 1; i >= 0; --i)
+						if (!skiprest && !planeDisabled[k][i])
+							switch (pixel) {
+							case PixelType::Single:
+								scenechange_lambda(reinterpret_cast<const float *>(srcp[i]), reinterpret_cast<const float *>(centerp), 0., i);
+								break;
+							case PixelType::Integer9to16:
+								scenechange_lambda(reinterpret_cast<const uint16_t *>(srcp[i]), reinterpret_cast<const uint16_t *>(centerp), 0ll, i);
+								break;
+							default:
+								scenechange_lambda(srcp[i], centerp, 0ll, i);
+								break;
+							}
+						else
+							planeDisabled[k][i] = true;
+					skiprest = false;
+					for (auto i = 0; i < d->radius_forward; ++i)
+						if (!skiprest && !planeDisabled[k][i + d->radius_back])
+							switch (pixel) {
+							case PixelType::Single:
+								scenechange_lambda(reinterpret_cast<const float *>(srcp[i + d->radius_back]), reinterpret_cast<const float *>(centerp), 0., i + d->radius_back);
+								break;
+							case PixelType::Integer9to16:
+								scenechange_lambda(reinterpret_cast<const uint16_t *>(srcp[i + d->radius_back]), reinterpret_cast<const uint16_t *>(centerp), 0ll, i + d->radius_back);
+								break;
+							default:
+								scenechange_lambda(srcp[i + d->radius_back], centerp, 0ll, i + d->radius_back);
+								break;
+							}
+						else
+							planeDisabled[k][i + d->radius_back] = true;
+					std::memcpy(srcp, srcp_trimmed, dd2 * sizeof(srcp[0]));
+					std::memcpy(src_stride, src_stride_trimmed, dd2 * sizeof(src_stride[0]));
+					dd = dd2;
+				}
+				if (dd < 1 && !skip) {
+					unfiltered[k] = true;
+					if (!d->convert)
+						continue;
+				}
+				auto &wnd = window[k];
+				std::memcpy(wnd.srcp, srcp, dd * sizeof(srcp[0]));
+				std::memcpy(wnd.src_stride, src_stride, dd * sizeof(src_stride[0]));
+				wnd.dd = dd;
+				wnd.centerp = centerp;
+				wnd.center_stride = center_stride;
+				wnd.dstp = dstp;
+				wnd.dst_stride = dst_stride;
+				wnd.active = true;
+			}
+			auto write = [&](auto &converter, auto dstp, auto x, auto sum, auto div) {
+				if (d->convert) {
+					converter.store(dstp, x, static_cast<double>(sum) / div);
+					return;
+				}
+				if (pixel != PixelType::Single) {
+					sum += div / 2;
+					sum /= div;
+					sum = sum < 0 ? 0 : sum > pmax ? pmax : sum;
+				}
+				else
+					sum /= div;
+				dstp[x] = static_cast<decltype(dstp[0] + 0)>(sum);
+			};
+			auto dispatch = [&](auto &wnd, auto &&f) {
+				auto with_output = [&](auto srcp, auto centerp, auto sum_type) {
+					switch (out_pixel) {
+					case PixelType::Single:
+						f(srcp, centerp, reinterpret_cast<float *>(wnd.dstp), sum_type);
+						break;
+					case PixelType::Integer9to16:
+						f(srcp, centerp, reinterpret_cast<uint16_t *>(wnd.dstp), sum_type);
+						break;
+					default:
+						f(srcp, centerp, wnd.dstp, sum_type);
+						break;
 					}
 				};
 				switch (pixel) {
 				case PixelType::Single:
-					accumulate_line(reinterpret_cast<const float **>(srcp), reinterpret_cast<float *>(dstp), 0.);
+					with_output(reinterpret_cast<const float **>(wnd.srcp), reinterpret_cast<const float *>(wnd.centerp), 0.);
 					break;
 				case PixelType::Integer9to16:
-					accumulate_line(reinterpret_cast<const uint16_t **>(srcp), reinterpret_cast<uint16_t *>(dstp), 0ll);
+					with_output(reinterpret_cast<const uint16_t **>(wnd.srcp), reinterpret_cast<const uint16_t *>(wnd.centerp), 0ll);
 					break;
 				default:
-					accumulate_line(srcp, dstp, 0ll);
+					with_output(wnd.srcp, wnd.centerp, 0ll);
 					break;
 				}
-				for (auto i = 0; i < dd; ++i)
-					srcp[i] += src_stride[i];
-				dstp += dst_stride;
+			};
+			for (auto y = 0; y < h; ++y) {
+				if ((y & 15) == 0)
+					drop_claimed();
+				for (auto k = 0; k < outputs; ++k) {
+					auto &wnd = window[k];
+					if (!wnd.active || dropped[k])
+						continue;
+					auto div = wnd.dd + 1;
+					auto pass_line = [&](auto, auto centerp, auto dstp, auto) {
+						if (d->convert)
+							for (auto x = 0; x < w; ++x)
+								converter[k].store(dstp, x, centerp[x]);
+					};
+					auto mean_line = [&](auto srcp, auto centerp, auto dstp, auto sum_type) {
+						using mean_type = typename std::conditional<std::is_integral<decltype(sum_type)>::value, int32_t, double>::type;
+						auto accumulator = lineBuffer<mean_type>(w);
+						for (auto x = 0; x < w; ++x)
+							accumulator[x] = centerp[x];
+						for (auto frame = wnd.dd - 1; frame >= 0; --frame) {
+							auto linep = srcp[frame];
+							for (auto x = 0; x < w; ++x)
+								accumulator[x] += linep[x];
+						}
+						if (!occupancy[k].full(y)) {
+							for (auto x = 0; x < w; ++x)
+								if (occupancy[k].pixel(x, y))
+									write(converter[k], dstp, x, accumulator[x], div);
+								else
+									write(converter[k], dstp, x, static_cast<decltype(sum_type)>(centerp[x]), 1);
+						}
+						else if (d->convert)
+							for (auto x = 0; x < w; ++x)
+								converter[k].store(dstp, x, static_cast<double>(accumulator[x]) / div);
+						else
+							storeMean(accumulator, dstp, w, div, pmax);
+					};
+					auto accumulate_line = [&](auto srcp, auto centerp, auto dstp, auto sum_type) {
+						for (auto x = 0; x < w; ++x) {
+							decltype(sum_type) sum = centerp[x];
+							if (!occupancy[k].pixel(x, y)) {
+								write(converter[k], dstp, x, sum, 1);
+								continue;
+							}
+							for (auto frame = wnd.dd - 1; frame >= 0; --frame) {
+								auto absolute = std::abs(static_cast<decltype(sum)>(centerp[x]) - srcp[frame][x]);
+								if (absolute <= current_threshold)
+									sum += srcp[frame][x];
+								else
+									sum += centerp[x];
+							}
+							write(converter[k], dstp, x, sum, div);
+						}
+					};
+					if (!occupancy[k].row(y))
+						dispatch(wnd, pass_line);
+					else if (saturated)
+						dispatch(wnd, mean_line);
+					else
+						dispatch(wnd, accumulate_line);
+					for (auto i = 0; i < wnd.dd; ++i)
+						wnd.srcp[i] += wnd.src_stride[i];
+					wnd.centerp += wnd.center_stride;
+					wnd.dstp += wnd.dst_stride;
+					converter[k].next_line();
+				}
 			}
 		}
 		for (auto x : src)
 			vsapi->freeFrame(x);
-		return dst;
+		for (auto x : mask)
+			vsapi->freeFrame(x);
+		if (batched) {
+			std::lock_guard<std::mutex> lock{ d->batch_mutex };
+			for (auto k = 0; k < outputs; ++k) {
+				if (group + k == n)
+					continue;
+				if (dropped[k] || d->batch_claimed.erase(group + k)) {
+					vsapi->freeFrame(dst[k]);
+					continue;
+				}
+				auto &stashed = d->batch_frames[group + k];
+				vsapi->freeFrame(stashed);
+				stashed = dst[k];
+			}
+			while (d->batch_frames.size() > static_cast<size_t>(d->batch) * 4) {
+				vsapi->freeFrame(d->batch_frames.begin()->second);
+				d->batch_frames.erase(d->batch_frames.begin());
+			}
+			d->batch_pending.erase(group);
+		}
+		return dst[n - group];
 	}
 	return nullptr;
 }
 
 auto VS_CC temporalsoftenFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
 	auto d = reinterpret_cast<TemporalSoftenData *>(instanceData);
+	for (auto &x : d->batch_frames)
+		vsapi->freeFrame(x.second);
 	vsapi->freeNode(d->node);
+	vsapi->freeNode(d->mask);
 	delete d;
 }
 
@@ -195,9 +367,15 @@ auto VS_CC temporalsoftenCreate(const VSMap *in, VSMap *out, void *userData, VSC
 		vsapi->freeNode(data->node);
 		return;
 	}
-	data->radius = static_cast<decltype(data->radius)>(vsapi->propGetInt(in, "radius", 0, &err));
+	auto radius = static_cast<int>(vsapi->propGetInt(in, "radius", 0, &err));
+	if (err)
+		radius = 4;
+	data->radius_back = static_cast<decltype(data->radius_back)>(vsapi->propGetInt(in, "radius_back", 0, &err));
+	if (err)
+		data->radius_back = radius;
+	data->radius_forward = static_cast<decltype(data->radius_forward)>(vsapi->propGetInt(in, "radius_forward", 0, &err));
 	if (err)
-		data->radius = 4;
+		data->radius_forward = radius;
 	data->luma_threshold = vsapi->propGetFloat(in, "luma_threshold", 0, &err);
 	if (err)
 		data->luma_threshold = 4.;
@@ -207,11 +385,34 @@ auto VS_CC temporalsoftenCreate(const VSMap *in, VSMap *out, void *userData, VSC
 	data->scenechange = vsapi->propGetFloat(in, "scenechange", 0, &err);
 	if (err)
 		data->scenechange = 0.;
-	if (data->radius < 1 || data->radius > 7) {
+	data->batch = static_cast<decltype(data->batch)>(vsapi->propGetInt(in, "batch", 0, &err));
+	if (err)
+		data->batch = 1;
+	if (radius < 1 || radius > 7) {
 		vsapi->setError(out, "TemporalSoften: radius must be between 1 and 7 (inclusive)");
 		vsapi->freeNode(data->node);
 		return;
 	}
+	if (data->radius_back < 0 || data->radius_back > 7) {
+		vsapi->setError(out, "TemporalSoften: radius_back must be between 0 and 7 (inclusive)");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	if (data->radius_forward < 0 || data->radius_forward > 7) {
+		vsapi->setError(out, "TemporalSoften: radius_forward must be between 0 and 7 (inclusive)");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	if (data->radius_back == 0 && data->radius_forward == 0) {
+		vsapi->setError(out, "TemporalSoften: radius_back and radius_forward can't both be 0");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	if (data->batch < 1 || data->batch > 16) {
+		vsapi->setError(out, "TemporalSoften: batch must be between 1 and 16 (inclusive)");
+		vsapi->freeNode(data->node);
+		return;
+	}
 	if (data->luma_threshold < 0. || data->luma_threshold > 255.) {
 		vsapi->setError(out, "TemporalSoften: luma_threshold must be between 0.0 and 255.0 (inclusive)");
 		vsapi->freeNode(data->node);
@@ -242,10 +443,58 @@ auto VS_CC temporalsoftenCreate(const VSMap *in, VSMap *out, void *userData, VSC
 		vsapi->freeNode(data->node);
 		return;
 	}
+	auto output_depth = static_cast<int>(vsapi->propGetInt(in, "output_depth", 0, &err));
+	auto same_format = err != 0;
+	if (err)
+		output_depth = data->vi->format->bitsPerSample;
+	data->dither = static_cast<DitherType>(vsapi->propGetInt(in, "dither", 0, &err));
+	if (err)
+		data->dither = DitherType::None;
+	if ((output_depth < 8 || output_depth > 16) && output_depth != 32) {
+		vsapi->setError(out, "TemporalSoften: output_depth must be between 8 and 16 (inclusive), or 32");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	if (data->dither != DitherType::None && data->dither != DitherType::Ordered && data->dither != DitherType::ErrorDiffusion) {
+		vsapi->setError(out, "TemporalSoften: dither must be 0 (round), 1 (ordered) or 2 (error diffusion)");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	data->out_vi = *data->vi;
+	data->out_vi.format = same_format ? data->vi->format : outputFormat(data->vi->format, output_depth, core, vsapi);
+	if (!data->out_vi.format) {
+		vsapi->setError(out, "TemporalSoften: output_depth is not supported for this input format");
+		vsapi->freeNode(data->node);
+		return;
+	}
+	data->convert = data->out_vi.format != data->vi->format || (data->dither != DitherType::None && data->out_vi.format->sampleType == stInteger);
+	data->mask = vsapi->propGetNode(in, "mask", 0, &err);
+	if (err)
+		data->mask = nullptr;
+	if (data->mask) {
+		auto mi = vsapi->getVideoInfo(data->mask);
+		auto error = static_cast<const char *>(nullptr);
+		if (!mi->format)
+			error = "TemporalSoften: only constant format mask supported";
+		else if (mi->format->bitsPerSample == 16 && mi->format->sampleType == stFloat)
+			error = "TemporalSoften: half precision mask not supported!";
+		else if (mi->width != data->vi->width || mi->height != data->vi->height)
+			error = "TemporalSoften: mask must have the same dimensions as clip";
+		else if (mi->format->colorFamily != cmGray && data->vi->format->colorFamily != cmGray && (mi->format->subSamplingW != data->vi->format->subSamplingW || mi->format->subSamplingH != data->vi->format->subSamplingH))
+			error = "TemporalSoften: mask must be Gray or have the same subsampling as clip";
+		else if (mi->numFrames < data->vi->numFrames)
+			error = "TemporalSoften: mask must have at least as many frames as clip";
+		if (error) {
+			vsapi->setError(out, error);
+			vsapi->freeNode(data->mask);
+			vsapi->freeNode(data->node);
+			return;
+		}
+	}
 	vsapi->createFilter(in, out, "TemporalSoften", temporalsoftenInit, temporalsoftenGetFrame, temporalsoftenFree, fmParallel, 0, data, core);
 	return;
 }
 
 auto temporalsoftenRegister(VSRegisterFunction registerFunc, VSPlugin *plugin) {
-	registerFunc("TemporalSoften", "clip:clip;radius:int:opt;luma_threshold:float:opt;chroma_threshold:float:opt;scenechange:float:opt", temporalsoftenCreate, 0, plugin);
+	registerFunc("TemporalSoften", "clip:clip;radius:int:opt;luma_threshold:float:opt;chroma_threshold:float:opt;scenechange:float:opt;batch:int:opt;output_depth:int:opt;dither:int:opt;mask:clip:opt;radius_back:int:opt;radius_forward:int:opt", temporalsoftenCreate, 0, plugin);
 }
@@ -2,6 +2,11 @@
 #include <algorithm>
 #include <cstring>
 #include <cmath>
+#include <type_traits>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
 #include "VapourSynth.h"
 
 enum class PixelType {
@@ -10,19 +15,269 @@ enum class PixelType {
 	Single = 4
 };
 
+enum class DitherType {
+	None = 0,
+	Ordered = 1,
+	ErrorDiffusion = 2
+};
+
 struct SpatialSoftenData final {
 	VSNodeRef *node = nullptr;
 	const VSVideoInfo *vi = nullptr;
+	VSVideoInfo out_vi = {};
 	int radius = 0;
 	double luma_threshold = 0.;
 	double chroma_threshold = 0.;
+	bool luma_saturated = false;
+	bool chroma_saturated = false;
+	DitherType dither = DitherType::None;
+	bool convert = false;
+	VSNodeRef *mask = nullptr;
 };
 
 struct TemporalSoftenData final {
 	VSNodeRef *node = nullptr;
 	const VSVideoInfo *vi = nullptr;
-	int radius = 0;
+	VSVideoInfo out_vi = {};
+	int radius_back = 0;
+	int radius_forward = 0;
 	double luma_threshold = 0.;
 	double chroma_threshold = 0.;
 	double scenechange = 0.;
+	bool luma_saturated = false;
+	bool chroma_saturated = false;
+	DitherType dither = DitherType::None;
+	bool convert = false;
+	int batch = 1;
+	VSNodeRef *mask = nullptr;
+	// batch > 1: the first request of a group renders every output of it and stashes the others in
+	// batch_frames for their own requests. A request arriving while its group is still being rendered
+	// never waits, it renders its single frame and claims it, the group's render then stops working on
+	// that output. Stashed frames (at most 4 * batch) are held outside the core's frame cache and its size limit
+	std::mutex batch_mutex;
+	std::set<int> batch_pending;
+	std::set<int> batch_claimed;
+	std::map<int, const VSFrameRef *> batch_frames;
+};
+
+// per output frame view of one plane, TemporalSoften walks all outputs of a batch row by row through these
+struct TemporalSoftenWindow final {
+	const uint8_t *srcp[16] = {};
+	int src_stride[16] = {};
+	int dd = 0;
+	const uint8_t *centerp = nullptr;
+	int center_stride = 0;
+	uint8_t *dstp = nullptr;
+	int dst_stride = 0;
+	bool active = false;
+};
+
+// maps the unrounded average of one plane straight to the output format, so the
+// accumulator never gets rounded to the input depth first
+struct DepthConverter final {
+	double scale = 1.;
+	double in_offset = 0.;
+	double out_offset = 0.;
+	double out_max = 0.;
+	DitherType dither = DitherType::None;
+	int y = 0;
+	std::vector<double> error;
+	size_t error_current = 0;
+	size_t error_next = 0;
+	// limited range follows the usual resizer convention: integer depths differ by a plain shift and
+	// float maps the nominal 16-235/16-240 (scaled to the depth) onto 0-1 and -0.5-0.5
+	DepthConverter(const VSFormat *in, const VSFormat *out, DitherType dither, int plane, int w, bool limited) {
+		auto chroma = plane > 0 && (in->colorFamily == cmYUV || in->colorFamily == cmYCoCg);
+		auto range = [&](auto fi) {
+			if (fi->sampleType == stFloat)
+				return 1.;
+			if (limited)
+				return (chroma ? 224. : 219.) * (1 << (fi->bitsPerSample - 8));
+			return static_cast<double>((1 << fi->bitsPerSample) - 1);
+		};
+		auto offset = [&](auto fi) {
+			if (fi->sampleType == stFloat)
+				return 0.;
+			if (limited)
+				return (chroma ? 128. : 16.) * (1 << (fi->bitsPerSample - 8));
+			return chroma ? static_cast<double>(1 << (fi->bitsPerSample - 1)) : 0.;
+		};
+		scale = range(out) / range(in);
+		in_offset = offset(in);
+		out_offset = offset(out);
+		out_max = out->sampleType == stFloat ? 1. : static_cast<double>((1 << out->bitsPerSample) - 1);
+		this->dither = out->sampleType == stFloat ? DitherType::None : dither;
+		if (this->dither == DitherType::ErrorDiffusion) {
+			error.assign(2 * (w + 2), 0.);
+			error_current = 0;
+			error_next = w + 2;
+		}
+	}
+	auto next_line() {
+		++y;
+		if (dither == DitherType::ErrorDiffusion) {
+			std::swap(error_current, error_next);
+			std::fill(error.begin() + error_next, error.begin() + error_next + error.size() / 2, 0.);
+		}
+	}
+	auto store(float *dstp, int x, double value) {
+		dstp[x] = static_cast<float>((value - in_offset) * scale + out_offset);
+	}
+	template<typename T>
+	auto store(T *dstp, int x, double value) {
+		static constexpr double bayer[8][8] = {
+			{ 0, 32, 8, 40, 2, 34, 10, 42 },
+			{ 48, 16, 56, 24, 50, 18, 58, 26 },
+			{ 12, 44, 4, 36, 14, 46, 6, 38 },
+			{ 60, 28, 52, 20, 62, 30, 54, 22 },
+			{ 3, 35, 11, 43, 1, 33, 9, 41 },
+			{ 51, 19, 59, 27, 49, 17, 57, 25 },
+			{ 15, 47, 7, 39, 13, 45, 5, 37 },
+			{ 63, 31, 55, 23, 61, 29, 53, 21 }
+		};
+		value = (value - in_offset) * scale + out_offset;
+		auto quantized = 0.;
+		switch (dither) {
+		case DitherType::Ordered:
+			quantized = std::floor(value + (bayer[y & 7][x & 7] + .5) / 64.);
+			break;
+		case DitherType::ErrorDiffusion:
+			value += error[error_current + x + 1];
+			quantized = std::floor(value + .5);
+			break;
+		default:
+			quantized = std::floor(value + .5);
+			break;
+		}
+		quantized = quantized < 0. ? 0. : quantized > out_max ? out_max : quantized;
+		if (dither == DitherType::ErrorDiffusion) {
+			auto residual = value - quantized;
+			error[error_current + x + 2] += residual * 7. / 16.;
+			error[error_next + x] += residual * 3. / 16.;
+			error[error_next + x + 1] += residual * 5. / 16.;
+			error[error_next + x + 2] += residual * 1. / 16.;
+		}
+		dstp[x] = static_cast<T>(quantized);
+	}
+	template<typename T1, typename T2>
+	auto convert_plane(const T1 *srcp, int src_stride, T2 *dstp, int dst_stride, int w, int h) {
+		for (auto y = 0; y < h; ++y) {
+			for (auto x = 0; x < w; ++x)
+				store(dstp, x, srcp[x]);
+			srcp += src_stride;
+			dstp += dst_stride;
+			next_line();
+		}
+	}
 };
+
+// state of every row of one plane under the optional mask clip: untouched rows are passed through
+// without filtering, fully selected rows are filtered without looking at the mask again and only
+// partly selected rows read it per pixel. Without a mask every row is fully selected
+struct MaskOccupancy final {
+	const uint8_t *maskp = nullptr;
+	int mask_stride = 0;
+	int bytes_per_sample = 0;
+	int shift_w = 0;
+	int shift_h = 0;
+	int occupied = 0;
+	std::vector<uint8_t> rows;
+	MaskOccupancy(const VSFrameRef *mask, int plane, int w, int h, const VSAPI *vsapi) {
+		occupied = h;
+		if (mask == nullptr)
+			return;
+		auto fm = vsapi->getFrameFormat(mask);
+		auto mask_plane = std::min(plane, fm->numPlanes - 1);
+		maskp = vsapi->getReadPtr(mask, mask_plane);
+		mask_stride = vsapi->getStride(mask, mask_plane);
+		bytes_per_sample = fm->bytesPerSample;
+		while ((w << shift_w) < vsapi->getFrameWidth(mask, mask_plane))
+			++shift_w;
+		while ((h << shift_h) < vsapi->getFrameHeight(mask, mask_plane))
+			++shift_h;
+		rows.resize(h);
+		occupied = 0;
+		auto scan = [&](auto maskp) {
+			for (auto y = 0; y < h; ++y) {
+				auto linep = maskp + (y << shift_h) * mask_stride / sizeof(maskp[0]);
+				auto count = 0;
+				for (auto x = 0; x < w; ++x)
+					count += linep[x << shift_w] != 0;
+				rows[y] = count == 0 ? 0 : count == w ? 2 : 1;
+				occupied += count != 0;
+			}
+		};
+		switch (static_cast<PixelType>(bytes_per_sample)) {
+		case PixelType::Single:
+			scan(reinterpret_cast<const float *>(maskp));
+			break;
+		case PixelType::Integer9to16:
+			scan(reinterpret_cast<const uint16_t *>(maskp));
+			break;
+		default:
+			scan(maskp);
+			break;
+		}
+	}
+	auto sample(int x, int y) const {
+		auto linep = maskp + (y << shift_h) * mask_stride;
+		switch (static_cast<PixelType>(bytes_per_sample)) {
+		case PixelType::Single:
+			return reinterpret_cast<const float *>(linep)[x << shift_w] != 0.f;
+		case PixelType::Integer9to16:
+			return reinterpret_cast<const uint16_t *>(linep)[x << shift_w] != 0;
+		default:
+			return linep[x << shift_w] != 0;
+		}
+	}
+	auto row(int y) const {
+		return rows.empty() || rows[y] != 0;
+	}
+	auto full(int y) const {
+		return rows.empty() || rows[y] == 2;
+	}
+	auto pixel(int x, int y) const {
+		return full(y) || (rows[y] != 0 && sample(x, y));
+	}
+};
+
+// scratch line reused by every frame rendered on the calling thread, it only ever grows
+template<typename T>
+inline auto lineBuffer(int w) {
+	static thread_local std::vector<T> buffer;
+	if (buffer.size() < static_cast<size_t>(w))
+		buffer.resize(w);
+	return buffer.data();
+}
+
+// rounded mean of an accumulated line, written to the input format. Integer sums stay below 2^20
+// (15 frames of 16 bit), far enough from each rounding step that the float reciprocal is exact
+template<typename T>
+inline auto storeMean(const int32_t *accumulator, T *dstp, int w, int div, int pmax) {
+	auto half = div / 2;
+	auto reciprocal = 1.f / div;
+	for (auto x = 0; x < w; ++x)
+		dstp[x] = static_cast<T>(std::min(static_cast<int32_t>((static_cast<float>(accumulator[x] + half) + .5f) * reciprocal), pmax));
+}
+
+template<typename T>
+inline auto storeMean(const double *accumulator, T *dstp, int w, int div, int) {
+	for (auto x = 0; x < w; ++x)
+		dstp[x] = static_cast<T>(accumulator[x] / div);
+}
+
+// _ColorRange of a frame, untagged RGB is taken as full range and everything else as limited
+inline auto limitedRange(const VSFrameRef *frame, const VSAPI *vsapi) {
+	auto err = 0;
+	auto range = vsapi->propGetInt(vsapi->getFramePropsRO(frame), "_ColorRange", 0, &err);
+	return err ? vsapi->getFrameFormat(frame)->colorFamily != cmRGB : range == 1;
+}
+
+// format of the output clip, the input's own format when the depth doesn't change. nullptr when the
+// core can't register the requested one
+inline auto outputFormat(const VSFormat *fi, int output_depth, VSCore *core, const VSAPI *vsapi) {
+	auto sample_type = output_depth == 32 ? stFloat : stInteger;
+	if (fi->bitsPerSample == output_depth && fi->sampleType == sample_type)
+		return fi;
+	return vsapi->registerFormat(fi->colorFamily, sample_type, output_depth, fi->subSamplingW, fi->subSamplingH, core);
+}